@@ -0,0 +1,47 @@
+//throughput of Lout::Histogram::record() from several threads at once
+//build: g++ -std=c++17 -O2 -I. lout.cpp bench/histogram_bench.cpp `pkg-config --cflags --libs Qt5Core icu-uc` -lpthread
+//usage: histogram_bench [max threads] [samples per thread]
+#include "lout.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    const size_t maxThreads = argc > 1 ? strtoul(argv[1], nullptr, 10) : thread::hardware_concurrency();
+    const size_t samples = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000000;
+    for(size_t threads = 1; threads <= max(maxThreads, size_t(1)); threads *= 2)
+    {
+        Lout::Histogram hist;
+        vector<thread> pool;
+        const auto start = chrono::steady_clock::now();
+        for(size_t t = 0; t < threads; ++t)
+        {
+            pool.emplace_back([&hist, samples, t]
+                              {
+                                  //cheap xorshift, so the values spread over many buckets
+                                  uint64_t x = 88172645463325252ull + t;
+                                  for(size_t i = 0; i < samples; ++i)
+                                  {
+                                      x ^= x << 13;
+                                      x ^= x >> 7;
+                                      x ^= x << 17;
+                                      hist.record(x >> (x & 63));
+                                  }
+                              });
+        }
+        for(auto& i: pool)
+        {
+            i.join();
+        }
+        const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        const double total = double(threads * samples);
+        cout << threads << " threads: " << total / elapsed.count() / 1e6 << "M samples/s, "
+             << elapsed.count() * 1e9 / samples << " ns per sample per thread" << endl;
+    }
+}
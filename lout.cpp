@@ -4,6 +4,7 @@
 #include <iomanip>
 #include <cmath>
 #include <cassert>
+#include <numeric>
 #include <unicode/utf8.h>
 
 #ifdef __FANCYLOGS_USE_QTDEBUG__
@@ -17,14 +18,17 @@ namespace win {
 #include <windows.h>
 
 }
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <csignal>
+#define STDOUT_FILENO 1
     size_t Lout::getWidth()
     {
         using namespace  win;
         if(reinterpret_cast<void*>(output.str.get())==reinterpret_cast<void*>(&cout))
         {
-            CONSOLE_SCREEN_BUFFER_INFO nfo;
-            GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE),&nfo);
-            return nfo.srWindow.Right-nfo.srWindow.Left-width;
+            return terminalColumns()-width;
         }
         else
         {
@@ -32,214 +36,1697 @@ namespace win {
         }
     }
 
+    size_t Lout::terminalColumns()
+    {
+        using namespace  win;
+        CONSOLE_SCREEN_BUFFER_INFO nfo;
+        GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE),&nfo);
+        return nfo.srWindow.Right-nfo.srWindow.Left;
+    }
+
+    size_t Lout::terminalRows()
+    {
+        using namespace  win;
+        CONSOLE_SCREEN_BUFFER_INFO nfo;
+        GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE),&nfo);
+        return nfo.srWindow.Bottom-nfo.srWindow.Top+1;
+    }
+
+    bool Lout::enableStatusBoard(const size_t , const size_t )
+    {
+        //the board draws with ANSI cursor movement, which this console path does not emit
+        return false;
+    }
+
     Lout &Color(Lout &out, const uint8_t )
     {
         return out;
     }
 
-    Lout &noColor(Lout &out)
+    Lout &noColor(Lout &out)
+    {
+        return out;
+    }
+
+    static int openAppend(const string& path)
+    {
+        return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+    }
+
+    static void closeFd(const int fd)
+    {
+        _close(fd);
+    }
+
+    static void writeAll(const int fd, const char* ptr, size_t len)
+    {
+        while(len)
+        {
+            const auto done = _write(fd, ptr, unsigned(len));
+            if(done <= 0)
+            {
+                break;
+            }
+            ptr += done;
+            len -= done;
+        }
+    }
+
+    void Lout::onFatalSignal(int sig)
+    {
+        emergencyFlush();
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+
+    void Lout::enableEmergencyFlush()
+    {
+        atexit([]
+               {
+                   //let the writer drain the console ring, only the signal path dumps it directly
+                   cout.flush();
+                   stopConsole();
+                   flushSinks();
+                   emergencyFlush();
+               });
+        signal(SIGSEGV, onFatalSignal);
+        signal(SIGABRT, onFatalSignal);
+    }
+
+#else
+#include <sys/ioctl.h> //ioctl() and TIOCGWINSZ
+#include <unistd.h> // for STDOUT_FILENO
+#include <signal.h>
+#include <fcntl.h>
+#include <cerrno>
+
+    size_t Lout::getWidth()
+    {
+        if(output.str.get()==&cout)
+        {
+            return terminalColumns()-width;
+        }
+        return 60;
+    }
+
+    size_t Lout::terminalColumns()
+    {
+        winsize size;
+        fill(reinterpret_cast<char*>(&size), reinterpret_cast<char*>(&size) + sizeof(size), 0);
+        ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
+        return size.ws_col;
+    }
+
+    size_t Lout::terminalRows()
+    {
+        winsize size;
+        fill(reinterpret_cast<char*>(&size), reinterpret_cast<char*>(&size) + sizeof(size), 0);
+        ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
+        return size.ws_row;
+    }
+
+    bool Lout::enableStatusBoard(const size_t lines, const size_t fps)
+    {
+        if(!isatty(STDOUT_FILENO) || structured() || !lines || !fps)
+        {
+            return false;
+        }
+        if(!consoleBuf.load())
+        {
+            //the board needs the console buffer, which can only be put in place before other threads log
+            if(liveStreams.load() > 1)
+            {
+                return false;
+            }
+            setConsoleOverflow(Block);
+        }
+        boardLines = lines;
+        boardPeriodMs = int(max(size_t(1), 1000 / fps));
+        return true;
+    }
+
+    Lout &Color(Lout &out, const uint8_t color)
+    {
+        if(out.toConsole())
+        {
+            lock_guard lck(out.output.mtx);
+            *out.output.str << "\033[1;" << int(color) << 'm';
+        }
+        return out;
+    }
+
+    Lout &noColor(Lout &out)
+    {
+        if(out.toConsole())
+        {
+            lock_guard lck(out.output.mtx);
+            *out.output.str << "\033[0m";
+        }
+        return out;
+    }
+
+    static int openAppend(const string& path)
+    {
+        return open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+
+    static void closeFd(const int fd)
+    {
+        close(fd);
+    }
+
+    //only write(2) here - this runs inside signal handlers
+    static void writeAll(const int fd, const char* ptr, size_t len)
+    {
+        while(len)
+        {
+            const auto done = write(fd, ptr, len);
+            if(done <= 0)
+            {
+                if(done < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            ptr += done;
+            len -= done;
+        }
+    }
+
+    void Lout::onFatalSignal(int sig)
+    {
+        emergencyFlush();
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+
+    void Lout::enableEmergencyFlush()
+    {
+        atexit([]
+               {
+                   //let the writer drain the console ring, only the signal path dumps it directly
+                   cout.flush();
+                   stopConsole();
+                   flushSinks();
+                   emergencyFlush();
+               });
+        struct sigaction act;
+        fill(reinterpret_cast<char*>(&act), reinterpret_cast<char*>(&act) + sizeof(act), 0);
+        act.sa_handler = onFatalSignal;
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_RESETHAND;
+        for(const auto sig: {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL})
+        {
+            sigaction(sig, &act, nullptr);
+        }
+    }
+
+#endif
+
+constexpr std::array<char,4> Lout::tickChars;
+thread_local Lout::ConsoleBuf::Staging Lout::ConsoleBuf::staging;
+
+Lout& operator <<(Lout &out, const QString &str)
+{    
+    const auto txt = str.toUtf8().toStdString();
+    return out << txt;
+}
+
+Lout& operator <<(Lout &out, const std::string &in)
+{
+    out.print(in);
+    return out;
+}
+
+auto Lout::tm()
+{
+    return std::chrono::steady_clock::now();
+}
+
+Lout::ProtectedStream& Lout::console()
+{
+    static ProtectedStream ret(true);
+    return ret;
+}
+
+Lout::ProtectedStream& Lout::streamAt(const size_t index)
+{
+    return segments[index / StreamSegment::size].load(memory_order_acquire)->streams[index % StreamSegment::size];
+}
+
+Lout::ProtectedStream& Lout::mkOutput()
+{
+    //the only live thread writes to console directly, like the first one did before
+    if(!liveStreams.fetch_add(1, memory_order_acq_rel) && !consoleTaken.exchange(true, memory_order_acq_rel))
+    {
+        return console();
+    }
+
+    auto head = freeStreams.load(memory_order_acquire);
+    while(const uint32_t top = head)
+    {
+        auto& ret = streamAt(top - 1);
+        const uint64_t next = ((head >> 32) + 1) << 32 | ret.nextFree.load(memory_order_relaxed);
+        if(freeStreams.compare_exchange_weak(head, next, memory_order_acq_rel, memory_order_acquire))
+        {
+            return ret;
+        }
+    }
+
+    const auto index = allocatedStreams.fetch_add(1, memory_order_acq_rel);
+    const auto seg = index / StreamSegment::size;
+    if(seg >= maxSegments)
+    {
+        cerr << "Lout: too many threads\n";
+        abort();
+    }
+    if(!segments[seg].load(memory_order_acquire))
+    {
+        auto fresh = new StreamSegment(seg * StreamSegment::size);
+        StreamSegment* expected = nullptr;
+        if(!segments[seg].compare_exchange_strong(expected, fresh, memory_order_acq_rel))
+        {
+            delete fresh;
+        }
+    }
+    return streamAt(index);
+}
+
+Lout::PendingBuf::int_type Lout::PendingBuf::overflow(int_type ch)
+{
+    auto full = cur.load(memory_order_relaxed);
+    if(!full->next)
+    {
+        full->next = make_unique<Chunk>();
+    }
+    //every chunk before cur is complete, the handler relies on it
+    cur.store(full->next.get(), memory_order_release);
+    setp(full->next->data.data(), full->next->data.data() + capacity);
+    if(!traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+streamsize Lout::PendingBuf::xsputn(const char *s, streamsize n)
+{
+    level = min(level, ConsoleBuf::level);
+    return streambuf::xsputn(s, n);
+}
+
+string Lout::PendingBuf::take(LogLevel& taken)
+{
+    taken = level;
+    level = DeepTrace;
+    string ret;
+    const auto last = cur.load(memory_order_relaxed);
+    for(auto i = &first; i != last; i = i->next.get())
+    {
+        ret.append(i->data.data(), capacity);
+    }
+    ret.append(pbase(), pptr());
+    cur.store(&first, memory_order_release);
+    setp(first.data.data(), first.data.data() + capacity);
+    return ret;
+}
+
+void Lout::PendingBuf::emergencyWrite(const int fd) const
+{
+    const auto last = cur.load(memory_order_acquire);
+    for(auto i = &first; i != last; i = i->next.get())
+    {
+        writeAll(fd, i->data.data(), capacity);
+    }
+    writeAll(fd, pbase(), pptr() - pbase());
+}
+
+Lout::ConsoleBuf::ConsoleBuf(const size_t capacity, const OverflowPolicy policy, const LogLevel keepLevel):
+    ring(max(capacity, size_t(1))),
+    policy(policy),
+    keepLevel(keepLevel),
+    writer(&ConsoleBuf::run, this)
+{
+}
+
+Lout::ConsoleBuf::~ConsoleBuf()
+{
+    stop();
+}
+
+void Lout::ConsoleBuf::configure(const size_t capacity, const OverflowPolicy policy, const LogLevel keepLevel)
+{
+    unique_lock lck(mtx);
+    //let the writer empty the ring first, so its layout can change under the lock
+    hasSpace.wait(lck, [this]
+                       {
+                           return !used || stopped;
+                       });
+    ring.assign(max(capacity, size_t(1)), 0);
+    head = 0;
+    this->policy = policy;
+    this->keepLevel = keepLevel;
+}
+
+void Lout::ConsoleBuf::stop()
+{
+    {
+        lock_guard lck(mtx);
+        stopping = true;
+    }
+    hasData.notify_one();
+    if(writer.joinable() && writer.get_id() != this_thread::get_id())
+    {
+        writer.join();
+    }
+}
+
+void Lout::ConsoleBuf::run()
+{
+    unique_lock lck(mtx);
+    for(;;)
+    {
+        const auto ready = [this]
+                           {
+                               return used || stopping;
+                           };
+        const chrono::milliseconds period(boardPeriodMs.load(memory_order_relaxed));
+        if(period.count())
+        {
+            hasData.wait_for(lck, period, ready);
+            if(chrono::steady_clock::now() - lastFrame >= period)
+            {
+                lck.unlock();
+                drawBoard();
+                lck.lock();
+            }
+        }
+        else
+        {
+            hasData.wait(lck, ready);
+        }
+        if(!used)
+        {
+            if(stopping)
+            {
+                if(boardRows)
+                {
+                    const auto out = "\0337" + releaseBoard() + "\0338";
+                    writeAll(STDOUT_FILENO, out.data(), out.size());
+                }
+                stopped = true;
+                hasSpace.notify_all();
+                return;
+            }
+            continue;
+        }
+        const auto len = min(used, ring.size() - head);
+        const auto ptr = ring.data() + head;
+        lck.unlock();
+        //the only place that may block on the pipe, nobody else waits for it unless policy is Block;
+        //with the board up the log scrolls inside the region above it, so the board is never touched here
+        writeAll(STDOUT_FILENO, ptr, len);
+        lck.lock();
+        head = (head + len) % ring.size();
+        used -= len;
+        if(!used && dropped)
+        {
+            const auto note = "\n[lout: " + to_string(dropped) + " bytes dropped, stdout was full]\n";
+            dropped = 0;
+            dropping = false;
+            lck.unlock();
+            writeAll(STDOUT_FILENO, note.data(), note.size());
+            lck.lock();
+        }
+        hasSpace.notify_all();
+    }
+}
+
+string Lout::ConsoleBuf::releaseBoard()
+{
+    //blank the board rows and give the whole screen back to the log; the caller saves the cursor
+    string out;
+    for(size_t i=0;i<boardRows;++i)
+    {
+        out += "\033[" + to_string(screenRows - boardRows + 1 + i) + ";1H\033[K";
+    }
+    out += "\033[r";
+    boardRows = 0;
+    shown.clear();
+    return out;
+}
+
+void Lout::ConsoleBuf::drawBoard()
+{
+    lastFrame = chrono::steady_clock::now();
+    const size_t width = max(size_t(20), terminalColumns()) - 1;
+    vector<vector<string>> frame;
+    {
+        lock_guard lck(boardMtx);
+        const auto& slots = boardSlots();
+        const size_t count = min(slots.size(), boardLines.load(memory_order_relaxed));
+        for(size_t i=0;i<count;++i)
+        {
+            const auto slot = slots[slots.size() - count + i];
+            const size_t total = max(size_t(1), slot->total.load(memory_order_relaxed));
+            const size_t cur = min(total, slot->cur.load(memory_order_relaxed));
+            //label takes a third of the line, then the bar, then the percentage
+            const size_t labelW = width / 3;
+            const size_t barW = width - labelW - 6;
+            const size_t filled = barW * cur / total;
+            vector<string> line;
+            line.reserve(width);
+            for(const unsigned char c: slot->label)
+            {
+                if((c & 0xC0) == 0x80 && !line.empty())
+                {
+                    line.back() += char(c);
+                }
+                else if(line.size() + 1 < labelW && c >= ' ')
+                {
+                    line.emplace_back(1, char(c));
+                }
+                else if(c >= ' ')
+                {
+                    break;
+                }
+            }
+            line.resize(labelW, " ");
+            for(size_t j=0;j<barW;++j)
+            {
+                line.emplace_back(j < filled ? "\u2588" : "\u2591");
+            }
+            stringstream pct;
+            pct << ' ' << setw(3) << 100 * cur / total << '%';
+            for(const char c: pct.str())
+            {
+                line.emplace_back(1, c);
+            }
+            line.resize(width, " ");
+            frame.push_back(move(line));
+        }
+    }
+
+    const size_t rows = terminalRows();
+    //at least two rows stay with the log
+    frame.resize(min(frame.size(), rows > 2 ? rows - 2 : 0));
+    //everything is drawn between a save and a restore of the log cursor
+    string out = "\0337";
+    if(frame.size() != boardRows || rows != screenRows || (!frame.empty() && frame[0].size() != shown[0].size()))
+    {
+        if(boardRows)
+        {
+            out += releaseBoard();
+        }
+        screenRows = rows;
+        boardRows = frame.size();
+        if(boardRows)
+        {
+            //index down and back up so the rows below the log line are free, keeping its column,
+            //then pin the log to the scroll region above the board
+            out += "\0338";
+            for(size_t i=0;i<boardRows;++i)
+            {
+                out += "\033D";
+            }
+            out += "\033[" + to_string(boardRows) + "A\0337\033[1;" + to_string(rows - boardRows) + "r";
+        }
+    }
+    //only the runs of cells that differ from what is on the screen; new rows are drawn whole
+    shown.resize(frame.size());
+    for(size_t i=0;i<frame.size();++i)
+    {
+        const auto& old = shown[i];
+        const auto row = "\033[" + to_string(rows - frame.size() + 1 + i) + ';';
+        for(size_t j=0;j<frame[i].size();)
+        {
+            if(j < old.size() && frame[i][j] == old[j])
+            {
+                ++j;
+                continue;
+            }
+            out += row + to_string(j + 1) + 'H';
+            for(; j<frame[i].size() && !(j < old.size() && frame[i][j] == old[j]); ++j)
+            {
+                out += frame[i][j];
+            }
+        }
+        if(old.empty())
+        {
+            out += "\033[K";
+        }
+    }
+    if(out.size() == 2)
+    {
+        return;
+    }
+    out += "\0338";
+    shown = move(frame);
+    writeAll(STDOUT_FILENO, out.data(), out.size());
+}
+
+void Lout::ConsoleBuf::put(const char *s, size_t n, const LogLevel lvl)
+{
+    unique_lock lck(mtx);
+    if(stopped)
+    {
+        writeAll(STDOUT_FILENO, s, n);
+        return;
+    }
+    const bool droppable = policy == Summary || (policy == DropByLevel && lvl > keepLevel);
+    //once something was dropped, keep dropping until the pipe drains; the cut may fall inside a line,
+    //the note written after the drain says how much is missing
+    if(droppable && (dropping || ring.size() - used < n))
+    {
+        dropping = true;
+        dropped += n;
+        return;
+    }
+    while(n)
+    {
+        hasSpace.wait(lck, [this]
+                           {
+                               return used < ring.size();
+                           });
+        const auto tail = (head + used) % ring.size();
+        const auto len = min({n, ring.size() - used, ring.size() - tail});
+        copy(s, s + len, ring.begin() + tail);
+        used += len;
+        s += len;
+        n -= len;
+        hasData.notify_one();
+    }
+}
+
+void Lout::ConsoleBuf::commit()
+{
+    if(staging.used)
+    {
+        const auto len = staging.used;
+        staging.used = 0;
+        put(staging.data.data(), len, staging.level);
+    }
+}
+
+Lout::ConsoleBuf::int_type Lout::ConsoleBuf::overflow(int_type ch)
+{
+    if(!traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+        const char c = traits_type::to_char_type(ch);
+        xsputn(&c, 1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+streamsize Lout::ConsoleBuf::xsputn(const char *s, streamsize n)
+{
+    if(staging.level != level || size_t(n) > Staging::size - staging.used)
+    {
+        commit();
+        staging.level = level;
+    }
+    if(size_t(n) >= Staging::size)
+    {
+        put(s, n, level);
+    }
+    else
+    {
+        copy(s, s + n, staging.data.begin() + staging.used);
+        staging.used += n;
+    }
+    return n;
+}
+
+int Lout::ConsoleBuf::sync()
+{
+    commit();
+    return 0;
+}
+
+void Lout::ConsoleBuf::emergencyWrite(const int fd) const
+{
+    const auto len = min(used, ring.size() - head);
+    writeAll(fd, ring.data() + head, len);
+    writeAll(fd, ring.data(), used - len);
+    //only the crashing thread's own staged bytes are reachable from here
+    writeAll(fd, staging.data.data(), staging.used);
+}
+
+vector<Lout::Progress::Slot*>& Lout::boardSlots()
+{
+    static vector<Progress::Slot*> ret;
+    return ret;
+}
+
+Lout::Progress::Progress(const string &label, const size_t total):slot(new Slot)
+{
+    slot->label = label;
+    slot->total = total;
+    lock_guard lck(boardMtx);
+    boardSlots().push_back(slot);
+}
+
+Lout::Progress::~Progress()
+{
+    {
+        lock_guard lck(boardMtx);
+        auto& slots = boardSlots();
+        slots.erase(find(slots.begin(), slots.end(), slot));
+    }
+    delete slot;
+}
+
+void Lout::setConsoleOverflow(const OverflowPolicy policy, const LogLevel keepLevel, const size_t capacity)
+{
+    lock_guard lck(globalMtx);
+    lock_guard clck(console().mtx);
+    cout.flush();
+    if(const auto buf = consoleBuf.load())
+    {
+        buf->configure(capacity, policy, keepLevel);
+        return;
+    }
+    //cout.rdbuf() itself is not synchronised, so it may only change before a second thread logs
+    assert(liveStreams.load() <= 1 && "setConsoleOverflow() has to be called before other threads log");
+    const auto buf = new ConsoleBuf(capacity, policy, keepLevel);
+    cout.rdbuf(buf);
+    consoleBuf = buf;
+    atexit(stopConsole);
+}
+
+void Lout::stopConsole()
+{
+    cout.flush();
+    if(const auto buf = consoleBuf.load())
+    {
+        buf->stop();
+    }
+}
+
+void Lout::syncLevel() const
+{
+    ConsoleBuf::level = ctx->logLevels.empty() ? Info : ctx->logLevels.top().level;
+}
+
+void Lout::emergencyFlush()
+{
+    //lock-free walk over every buffer, so that it works from a signal handler too;
+    //buffers being written right now may come out torn, but nothing is lost silently
+    if(emergencyFlushed.exchange(true))
+    {
+        return;
+    }
+    if(const auto buf = consoleBuf.load())
+    {
+        buf->emergencyWrite(STDOUT_FILENO);
+    }
+    forEachStream([](const ProtectedStream& i)
+                  {
+                      i.pending.emergencyWrite(STDOUT_FILENO);
+                  });
+    //file sinks keep their bytes where write(2) can reach them; others are flushed on the atexit path only
+    forEachSink([](const Sink& i)
+                {
+                    if(i.file)
+                    {
+                        i.file->emergencyWrite();
+                    }
+                });
+}
+
+void Lout::releaseOutput(ProtectedStream &out)
+{
+    if(&out == &console())
+    {
+        consoleTaken.store(false, memory_order_release);
+    }
+    else
+    {
+        {
+            lock_guard lck(out.mtx);
+            //let brackets() pick up whatever the thread left unfinished
+            out.lastWasBrackets = true;
+        }
+        auto head = freeStreams.load(memory_order_acquire);
+        uint64_t next;
+        do
+        {
+            out.nextFree.store(uint32_t(head), memory_order_relaxed);
+            next = ((head >> 32) + 1) << 32 | (out.index + 1);
+        }
+        while(!freeStreams.compare_exchange_weak(head, next, memory_order_acq_rel, memory_order_acquire));
+    }
+    liveStreams.fetch_sub(1, memory_order_acq_rel);
+}
+
+void Lout::nextTick()
+{
+    if(toConsole())
+    {
+        if(++ctx->curTick==tickChars.cend())
+        {
+            ctx->curTick=tickChars.cbegin();
+        }
+        resetX();
+        shift(getWidth());
+        indent(brWidth+2,'\b','\b');
+        noBr();
+    }
+}
+
+void Lout::shift(size_t count)
+{
+    ctx->lastX.top()+=count;
+}
+
+void Lout::resetX()
+{
+    ctx->lastX.top()=0;
+}
+
+size_t Lout::getLastX() const
+{
+    return ctx->lastX.top();
+}
+
+void Lout::printBrackets(const string& str, const int color)
+{
+    lock_guard lck(output.mtx);
+    const auto midpos=str.length()/2;
+    const auto strHalfL=str.substr(0,midpos);
+    const auto strHalfR=str.substr(midpos);
+    constexpr size_t half=brWidth/2;
+    *this << setColor(color);
+    *output.str << right << '['<< setfill(' ') << setw(half) << right;
+    std::operator<<(*output.str,strHalfL);
+    *output.str << setw(half) << left;
+    std::operator<<(*output.str,strHalfR);
+    *output.str << ']';
+    *this<<noColor << flush;
+}
+
+
+
+Lout& Lout::brackets(const string &str, const int color )
+{
+    if(canMessage())
+    {
+        if(ctx->recordOpen || toRecord())
+        {
+            emitRecord(str);
+        }
+        if(ctx->recordNest)
+        {
+            --ctx->recordNest;
+        }
+        else
+        {
+            ctx->recordLineOpen = false;
+        }
+
+        vector<pair<LogLevel, string>> threadLogs;
+        {
+            unique_lock lck(globalMtx);
+            forEachStream([&threadLogs](ProtectedStream& i)
+                          {
+                              lock_guard lck(i.mtx);
+                              //structured records are always whole lines
+                              if(i.lastWasBrackets || structured())
+                              {
+                                  LogLevel level;
+                                  auto text = i.pending.take(level);
+                                  if(!text.empty())
+                                  {
+                                      threadLogs.emplace_back(level, move(text));
+                                  }
+                              }
+                          });
+        }
+
+        if(toConsole())
+        {
+            if(ctx->lastWasBrackets)
+            {
+    //            *output.str << '\n';
+            }
+            else
+            {
+                const auto countOfindention = getWidth() - ctx->lastX.top();
+                indentElapsed(countOfindention);
+                printBrackets(str, color);
+            }
+
+            if(ctx->lastX.size()>1)
+            {
+                ctx->lastX.pop();
+
+                if(ctx->lastWasBrackets)
+                {
+                    const auto countOfindention = getWidth()  + fmt.size() + 7 ;
+                    indentElapsed(countOfindention);
+                    printBrackets(str, color);
+                }
+            }
+            else
+            {
+                resetX();
+            }
+            {
+                //read by other threads draining pending output
+                lock_guard lck(output.mtx);
+                output.lastWasBrackets = true;
+            }
+            ctx->lastWasBrackets = true;
+            ctx->hasAnounce = false;
+        }
+        if(!threadLogs.empty())
+        {
+            //the console classifies bytes by the writer's level, here that is the worker's, not ours
+            for(const auto& [level, text]: threadLogs)
+            {
+                ConsoleBuf::level = level;
+                cout << text << flush;
+            }
+            syncLevel();
+        }
+    }
+    elapsedNote.clear();
+    return *this;
+}
+
+void Lout::indentElapsed(const size_t cnt)
+{
+    //the duration takes the place of the padding right before the bracket
+    const auto len = min(cnt, elapsedNote.empty() ? size_t(0) : elapsedNote.size() + 1);
+    indent(cnt - len, ' ', ' ');
+    if(len)
+    {
+        lock_guard lck(output.mtx);
+        *output.str << elapsedNote.substr(0, len - 1) << ' ';
+    }
+}
+
+static string jsonEscape(const string_view in)
+{
+    string ret;
+    ret.reserve(in.size() + 2);
+    ret += '"';
+    for(const char c: in)
+    {
+        switch(c)
+        {
+        case '"':  ret += "\\\""; break;
+        case '\\': ret += "\\\\"; break;
+        case '\n': ret += "\\n"; break;
+        case '\r': ret += "\\r"; break;
+        case '\t': ret += "\\t"; break;
+        default:
+            if(static_cast<unsigned char>(c) < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                ret += buf;
+            }
+            else
+            {
+                ret += c;
+            }
+        }
+    }
+    ret += '"';
+    return ret;
+}
+
+void Lout::setOutputFormat(const OutputFormat format)
+{
+    outputFormat = format;
+}
+
+Lout::OutputFormat Lout::getOutputFormat()
+{
+    auto ret = outputFormat.load(memory_order_relaxed);
+    if(ret == Auto)
+    {
+        auto resolved = isatty(STDOUT_FILENO) ? Fancy : JsonLines;
+        outputFormat.compare_exchange_strong(ret, resolved);
+        ret = outputFormat.load(memory_order_relaxed);
+    }
+    return ret;
+}
+
+bool Lout::structured()
+{
+    return getOutputFormat() != Fancy;
+}
+
+void Lout::startRecord()
+{
+    ctx->recordOpen = true;
+    ctx->recordDepth = ctx->recordNest;
+    ctx->recordFilter = ctx->logLevels.top();
+    ctx->recordTs = chrono::system_clock::now();
+    ctx->recordMsg.clear();
+}
+
+void Lout::emitRecord(const string &status)
+{
+    static constexpr array<const char*, 5> levelNames{"Info", "WorkFlow", "Debug", "Trace", "DeepTrace"};
+    if((!ctx->recordOpen && status.empty()) || ctx->logLevels.empty())
+    {
+        return;
+    }
+    if(!ctx->recordOpen)
+    {
+        startRecord();
+    }
+    if(threadName.empty())
+    {
+        stringstream id;
+        id << this_thread::get_id();
+        threadName = id.str();
+    }
+    const auto ts = chrono::duration<double>(ctx->recordTs.time_since_epoch()).count();
+    const auto level = ctx->recordFilter.level;
+    const auto mask = ctx->recordFilter.mask;
+    const auto channel = ctx->recordFilter.channel.name;
+    //formatted lazily, at most once per format, and shared by all sinks using it
+    array<string, 2> lines;
+    const auto format = [&](const OutputFormat kind) -> const string&
+    {
+        auto& ret = lines[kind == Logfmt];
+        if(!ret.empty())
+        {
+            return ret;
+        }
+        stringstream line;
+        line << fixed << setprecision(3);
+        if(kind == Logfmt)
+        {
+            line << "ts=" << ts
+                 << " thread=" << threadName
+                 << " depth=" << ctx->recordDepth
+                 << " level=" << levelNames[level]
+                 << " mask=0x" << hex << mask.getValue() << dec;
+            if(channel)
+            {
+                line << " channel=" << *channel;
+            }
+            line << " msg=" << jsonEscape(ctx->recordMsg);
+            if(!status.empty())
+            {
+                line << " status=" << jsonEscape(status);
+            }
+        }
+        else
+        {
+            line << "{\"ts\":" << ts
+                 << ",\"thread\":" << jsonEscape(threadName)
+                 << ",\"depth\":" << ctx->recordDepth
+                 << ",\"level\":\"" << levelNames[level]
+                 << "\",\"mask\":\"0x" << hex << mask.getValue() << dec << '"';
+            if(channel)
+            {
+                line << ",\"channel\":" << jsonEscape(*channel);
+            }
+            line << ",\"msg\":" << jsonEscape(ctx->recordMsg)
+                 << ",\"status\":" << jsonEscape(status) << '}';
+        }
+        line << '\n';
+        ret = line.str();
+        return ret;
+    };
+
+    if(structured() && ctx->recordFilter.channel.allows(level, outLevel) && outFilterMask & mask)
+    {
+        lock_guard lck(output.mtx);
+        std::operator<<(*output.str, format(getOutputFormat()));
+        *this << flush;
+    }
+    forEachSink([&](Sink& i)
+                {
+                    if(level <= i.level && ctx->recordFilter.channel.enabled() && i.mask & mask)
+                    {
+                        const auto& line = format(i.format);
+                        lock_guard lck(i.mtx);
+                        if(i.index)
+                        {
+                            i.indexRecord(ts, threadName, line.size());
+                        }
+                        i.str->write(line.data(), line.size());
+                    }
+                });
+    ctx->recordOpen = false;
+    ctx->recordMsg.clear();
+}
+
+bool Lout::enableTrace(const string &path)
+{
+    console();
+    lock_guard lck(globalMtx);
+    if(traceFile)
+    {
+        return true;
+    }
+    auto file = new ofstream(path, ios::binary | ios::trunc);
+    if(!*file)
+    {
+        delete file;
+        return false;
+    }
+    //every event is written with a leading comma, so the array opens with a metadata record
+    *file << "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"lout\"}}";
+    traceStart = tm();
+    {
+        lock_guard tlck(traceMtx);
+        traceFile = file;
+    }
+    traceEnabled = true;
+    static bool registered = false;
+    if(!registered)
+    {
+        registered = true;
+        atexit(disableTrace);
+    }
+    return true;
+}
+
+void Lout::disableTrace()
+{
+    lock_guard lck(globalMtx);
+    if(!traceFile)
+    {
+        return;
+    }
+    traceEnabled = false;
+    flushTrace(console());
+    forEachStream(flushTrace);
+    lock_guard tlck(traceMtx);
+    *traceFile << "\n]\n";
+    delete traceFile;
+    traceFile = nullptr;
+}
+
+void Lout::flushTrace(ProtectedStream &out)
+{
+    string data;
+    {
+        lock_guard lck(out.mtx);
+        swap(data, out.trace);
+    }
+    lock_guard lck(traceMtx);
+    if(traceFile && !data.empty())
+    {
+        traceFile->write(data.data(), data.size());
+    }
+}
+
+void Lout::traceEvent(const string &name, const char phase, const chrono::steady_clock::time_point at, const string &rest)
+{
+    constexpr size_t flushSize = 64 * 1024;
+    const auto ts = chrono::duration<double, micro>(at - traceStart).count();
+    unique_lock lck(output.mtx);
+    if(!traceNamed)
+    {
+        traceNamed = true;
+        stringstream id;
+        id << this_thread::get_id();
+        output.trace += ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + to_string(traceTid)
+                     + ",\"args\":{\"name\":" + jsonEscape(id.str()) + "}}";
+    }
+    stringstream str;
+    str << fixed << setprecision(3)
+        << ",\n{\"name\":" << jsonEscape(name) << ",\"cat\":\"lout\",\"ph\":\"" << phase
+        << "\",\"ts\":" << ts << ",\"pid\":1,\"tid\":" << traceTid << rest << '}';
+    output.trace += str.str();
+    if(output.trace.size() > flushSize)
+    {
+        lck.unlock();
+        flushTrace(output);
+    }
+}
+
+static string shortDuration(const uint64_t ns)
+{
+    stringstream str;
+    str << setprecision(3);
+    if(ns < 1000)
+    {
+        str << ns << "ns";
+    }
+    else if(ns < 1000000)
+    {
+        str << ns / 1e3 << "us";
+    }
+    else if(ns < 1000000000)
+    {
+        str << ns / 1e6 << "ms";
+    }
+    else
+    {
+        str << ns / 1e9 << 's';
+    }
+    return str.str();
+}
+
+map<string, unique_ptr<Lout::Timing>>& Lout::timings()
+{
+    static map<string, unique_ptr<Timing>> ret;
+    return ret;
+}
+
+void Lout::enableTiming(const bool enable)
+{
+    timingEnabled = enable;
+}
+
+Lout& Lout::finish(const string &str, const int color)
+{
+    if(canMessage() && !ctx->spans.empty())
+    {
+        const auto now = tm();
+        const uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(now - ctx->spans.top().start).count();
+        if(traceEnabled.load(memory_order_relaxed))
+        {
+            stringstream rest;
+            rest << fixed << setprecision(3)
+                 << ",\"dur\":" << chrono::duration<double, micro>(now - ctx->spans.top().start).count()
+                 << ",\"args\":{\"status\":" << jsonEscape(str) << '}';
+            traceEvent(ctx->spans.top().site, 'X', ctx->spans.top().start, rest.str());
+        }
+        if(timingEnabled.load(memory_order_relaxed))
+        {
+            Timing* site;
+            {
+                const auto& key = ctx->spans.top().key;
+                const auto name = key.empty() ? string("(built names)") : key;
+                lock_guard lck(timingsMtx);
+                auto& all = timings();
+                auto found = all.find(name);
+                if(found == all.end())
+                {
+                    found = all.emplace(all.size() < maxTimingSites ? name : string("(other sites)"), nullptr).first;
+                }
+                auto& ptr = found->second;
+                if(!ptr)
+                {
+                    ptr = make_unique<Timing>();
+                }
+                site = ptr.get();
+            }
+            site->count.fetch_add(1, memory_order_relaxed);
+            site->sum.fetch_add(ns, memory_order_relaxed);
+            for(auto old = site->min.load(memory_order_relaxed); ns < old && !site->min.compare_exchange_weak(old, ns, memory_order_relaxed););
+            for(auto old = site->max.load(memory_order_relaxed); ns > old && !site->max.compare_exchange_weak(old, ns, memory_order_relaxed););
+            site->hist.record(ns);
+            elapsedNote = shortDuration(ns);
+        }
+        ctx->spans.pop();
+        ctx->progress.reset();
+    }
+    return brackets(str, color);
+}
+
+Lout& Lout::printTimings()
+{
+    struct Row
+    {
+        string site;
+        uint64_t count, sum, min, max, p99;
+    };
+    vector<Row> rows;
+    {
+        lock_guard lck(timingsMtx);
+        for(const auto& [site, t]: timings())
+        {
+            rows.push_back({site,
+                            t->count.load(memory_order_relaxed),
+                            t->sum.load(memory_order_relaxed),
+                            t->min.load(memory_order_relaxed),
+                            t->max.load(memory_order_relaxed),
+                            t->hist.percentile(0.99)});
+        }
+    }
+    *this << anounce << "Timings";
+    for(const auto& i: rows)
+    {
+        *this << ::newLine << i.site << ": n=" << size_t(i.count)
+              << " avg=" << shortDuration(i.count ? i.sum / i.count : 0)
+              << " min=" << shortDuration(i.min)
+              << " p99=" << shortDuration(min(i.p99, i.max))
+              << " max=" << shortDuration(i.max);
+    }
+    return *this << ok;
+}
+
+void Lout::tick()
+{    
+    if(canMessage() && traceEnabled.load(memory_order_relaxed))
+    {
+        traceEvent(ctx->spans.empty() ? string("ticks") : "ticks " + ctx->spans.top().site, 'C', tm(),
+                   ",\"args\":{\"ticks\":" + to_string(++ctx->ticks) + '}');
+    }
+    brackets(std::string(1, *ctx->curTick), 33);
+    nextTick();
+}
+
+void Lout::percent(const size_t cur, const size_t total)
+{
+    if(canMessage())
+    {
+        const size_t percent = 100 * cur / total;
+        if(traceEnabled.load(memory_order_relaxed))
+        {
+            traceEvent(ctx->spans.empty() ? string("percent") : "percent " + ctx->spans.top().site, 'C', tm(),
+                       ",\"args\":{\"percent\":" + to_string(percent) + '}');
+        }
+        if(boardPeriodMs.load(memory_order_relaxed) && toConsole())
+        {
+            //the status board shows it, nothing is written into the log
+            if(!ctx->progress)
+            {
+                ctx->progress = make_unique<Progress>(ctx->spans.empty() ? string() : ctx->spans.top().site, total);
+            }
+            ctx->progress->set(cur, total);
+            return;
+        }
+        stringstream str;
+        str << *ctx->curTick << ' ' << setw(3) << percent << '%';
+        brackets(str.str(), 33);
+        nextTick();
+    }
+}
+
+Lout::Lout():
+             output(mkOutput()),
+             bars{"\u2591", "\u2588"},
+             traceTid(nextTraceTid++),
+             fmt("dd.MM.yyyy hh:mm:ss.zzz"),
+             width(fmt.size()+1+brWidth+8)
+{    
+    syncLevel();
+}
+
+Lout::Context::Context()
+{
+    lastX.push(0);
+    logLevels.push({Info, MessageMask(1), Channel()});
+}
+
+Lout::Context* Lout::switchContext(Context *next)
+{
+    const auto prev = ctx;
+    lock_guard lck(output.mtx);
+    if(!prev->lastWasBrackets)
+    {
+        //the open line stays with the context; this stream is free to be drained and reused
+        output.lastWasBrackets = true;
+        *output.str << flush;
+    }
+    ctx = next ? next : &ownCtx;
+    syncLevel();
+    if(!ctx->lastWasBrackets && toConsole())
+    {
+        //the line was started elsewhere, carry on below it at the same depth
+        resetX();
+        *output.str << '\n';
+        indentLineStart();
+        ctx->hasAnounce = true;
+        output.lastWasBrackets = false;
+    }
+    return prev;
+}
+
+Lout::ContextScope::ContextScope(Context &ctx):prev(lout.switchContext(&ctx))
+{
+}
+
+Lout::ContextScope::~ContextScope()
+{
+    lout.switchContext(prev);
+}
+
+bool Lout::consoleFilter() const
+{
+    const auto& top = ctx->logLevels.top();
+    return top.channel.allows(top.level, outLevel) && outFilterMask & top.mask;
+}
+
+bool Lout::sinksFilter() const
+{
+    const auto& top = ctx->logLevels.top();
+    return int(top.level) <= sinkLevel.load(memory_order_relaxed)
+           && top.channel.enabled()
+           && MessageMask(sinkMask.load(memory_order_relaxed)) & top.mask;
+}
+
+map<string, Lout::ChannelInfo*>& Lout::channels()
+{
+    static map<string, ChannelInfo*> ret;
+    return ret;
+}
+
+map<string, int>& Lout::channelRules()
+{
+    static map<string, int> ret;
+    return ret;
+}
+
+int Lout::resolveChannel(const string &name)
+{
+    //exact name beats "prefix.*", a longer prefix beats a shorter one, "*" is the last resort
+    const auto& rules = channelRules();
+    if(const auto pos = rules.find(name); pos != rules.cend())
     {
-        return out;
+        return pos->second;
     }
-
-#else
-#include <sys/ioctl.h> //ioctl() and TIOCGWINSZ
-#include <unistd.h> // for STDOUT_FILENO
-
-    size_t Lout::getWidth()
+    for(auto prefix = name;;)
     {
-        if(output.str.get()==&cout)
+        if(const auto pos = rules.find(prefix + ".*"); pos != rules.cend())
         {
-            winsize size;
-            fill(reinterpret_cast<char*>(&size), reinterpret_cast<char*>(&size) + sizeof(size), 0);
-            ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
-            return size.ws_col-width;
+            return pos->second;
         }
-        return 60;
+        const auto dot = prefix.rfind('.');
+        if(dot == string::npos)
+        {
+            break;
+        }
+        prefix.resize(dot);
     }
+    const auto pos = rules.find("*");
+    return pos != rules.cend() ? pos->second : inheritLevel;
+}
 
-    Lout &Color(Lout &out, const uint8_t color)
+void Lout::setChannelRule(const string &pattern, const int threshold)
+{
+    lock_guard lck(channelsMtx);
+    channelRules()[pattern] = threshold;
+    rootThreshold = resolveChannel(string());
+    for(const auto& [name, info]: channels())
     {
-        if(out.canMessage())
-        {
-            lock_guard lck(out.output.mtx);
-            *out.output.str << "\033[1;" << int(color) << 'm';
-        }
-        return out;
+        info->threshold.store(resolveChannel(name), memory_order_relaxed);
     }
+}
 
-    Lout &noColor(Lout &out)
+Lout::Channel Lout::channel(const string &name)
+{
+    if(name.empty())
     {
-        if(out.canMessage())
-        {
-            lock_guard lck(out.output.mtx);
-            *out.output.str << "\033[0m";
-        }
-        return out;
+        return Channel();
+    }
+    lock_guard lck(channelsMtx);
+    auto& info = channels()[name];
+    if(!info)
+    {
+        //never freed: handles keep pointing into it
+        info = new ChannelInfo;
+        info->name = name;
+        info->threshold = resolveChannel(name);
     }
+    return Channel(&info->threshold, &info->name);
+}
 
-#endif
+void Lout::setChannelLevel(const string &pattern, const LogLevel level)
+{
+    setChannelRule(pattern, level);
+}
 
-constexpr std::array<char,4> Lout::tickChars;
+void Lout::disableChannel(const string &pattern)
+{
+    setChannelRule(pattern, offLevel);
+}
 
-Lout& operator <<(Lout &out, const QString &str)
-{    
-    const auto txt = str.toUtf8().toStdString();
-    return out << txt;
+bool Lout::canMessage() const
+{
+    return consoleFilter() || sinksFilter();
 }
 
-Lout& operator <<(Lout &out, const std::string &in)
+bool Lout::toConsole() const
 {
-    out.print(in);
-    return out;
+    return !structured() && consoleFilter();
 }
 
-auto Lout::tm()
+bool Lout::toRecord() const
 {
-    return std::chrono::system_clock::now();
+    return sinksFilter() || (structured() && consoleFilter());
 }
 
-void Lout::nextTick()
+bool Lout::registerSink(Sink *sink)
 {
-    if(canMessage())
+    lock_guard lck(globalMtx);
+    const auto idx = sinkCount.load(memory_order_relaxed);
+    if(idx >= maxSinks)
+    {
+        delete sink;
+        return false;
+    }
+    sinks[idx] = sink;
+    sinkCount.store(idx + 1, memory_order_release);
+    sinkLevel = max(sinkLevel.load(), int(sink->level));
+    sinkMask = sinkMask.load() | sink->mask.getValue();
+    if(!idx)
+    {
+        atexit(flushSinks);
+    }
+    return true;
+}
+
+bool Lout::addSink(ostream &str, const LogLevel level, const MessageMask mask, const OutputFormat format)
+{
+    auto sink = new Sink;
+    sink->str = &str;
+    sink->level = level;
+    sink->mask = mask;
+    sink->format = format == Logfmt ? Logfmt : JsonLines;
+    return registerSink(sink);
+}
+
+bool Lout::addSink(const string &path, const LogLevel level, const MessageMask mask, const OutputFormat format, const size_t indexBlock)
+{
+    const auto fd = openAppend(path);
+    if(fd < 0)
+    {
+        return false;
+    }
+    //sinks live until exit, so the sink owns its file
+    auto sink = new Sink;
+    sink->file = make_unique<FileBuf>(fd);
+    sink->owned = make_unique<ostream>(sink->file.get());
+    sink->str = sink->owned.get();
+    sink->level = level;
+    sink->mask = mask;
+    sink->format = format == Logfmt ? Logfmt : JsonLines;
+    if(indexBlock)
+    {
+        sink->index = make_unique<ofstream>(path + ".idx", ios::binary | ios::app);
+        sink->indexBlock = indexBlock;
+        sink->offset = sink->blockStart = ifstream(path, ios::binary | ios::ate).tellg();
+    }
+    return registerSink(sink);
+}
+
+void Lout::Sink::indexRecord(const double ts, const string &thread, const size_t len)
+{
+    if(offset >= blockStart + indexBlock)
+    {
+        closeBlock();
+    }
+    if(blockThreads.empty())
+    {
+        minTs = maxTs = ts;
+    }
+    minTs = min(minTs, ts);
+    maxTs = max(maxTs, ts);
+    auto& runs = blockThreads[thread];
+    if(!runs.empty() && runs.back().second == offset)
+    {
+        runs.back().second += len;
+    }
+    else
+    {
+        runs.emplace_back(offset, offset + len);
+    }
+    offset += len;
+}
+
+void Lout::Sink::closeBlock()
+{
+    if(!blockThreads.empty())
     {
-        if(++curTick==tickChars.cend())
+        *index << "B " << blockStart << ' ' << offset << fixed << setprecision(3) << ' ' << minTs << ' ' << maxTs << '\n';
+        for(const auto& [thread, runs]: blockThreads)
         {
-            curTick=tickChars.cbegin();
+            *index << "T " << thread;
+            for(const auto& [start, end]: runs)
+            {
+                *index << ' ' << start << '-' << end;
+            }
+            *index << '\n';
         }
-        resetX();
-        shift(getWidth());
-        indent(brWidth+2,'\b','\b');
-        noBr();
+        blockThreads.clear();
     }
+    blockStart = offset;
 }
 
-void Lout::shift(size_t count)
+Lout::FileBuf::int_type Lout::FileBuf::overflow(int_type ch)
 {
-    lastX.top()+=count;
+    sync();
+    if(!traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
 }
 
-void Lout::resetX()
+int Lout::FileBuf::sync()
 {
-    lastX.top()=0;
+    writeAll(fd, pbase(), pptr() - pbase());
+    setp(data.data(), data.data() + capacity);
+    return 0;
 }
 
-size_t Lout::getLastX() const
+Lout::FileBuf::~FileBuf()
 {
-    return lastX.top();
+    sync();
+    closeFd(fd);
 }
 
-void Lout::printBrackets(const string& str, const int color)
+void Lout::FileBuf::emergencyWrite() const
 {
-    lock_guard lck(output.mtx);
-    const auto midpos=str.length()/2;
-    const auto strHalfL=str.substr(0,midpos);
-    const auto strHalfR=str.substr(midpos);
-    constexpr size_t half=brWidth/2;
-    *this << setColor(color);
-    *output.str << right << '['<< setfill(' ') << setw(half) << right;
-    std::operator<<(*output.str,strHalfL);
-    *output.str << setw(half) << left;
-    std::operator<<(*output.str,strHalfR);
-    *output.str << ']';
-    *this<<noColor << flush;
+    writeAll(fd, pbase(), pptr() - pbase());
 }
 
+void Lout::flushSinks()
+{
+    forEachSink([](Sink& i)
+                {
+                    lock_guard lck(i.mtx);
+                    i.str->flush();
+                    if(i.index)
+                    {
+                        i.closeBlock();
+                        i.index->flush();
+                    }
+                });
+}
 
-
-Lout& Lout::brackets(const string &str, const int color )
+//value of a record field in either structured format, escapes are left as they are
+static string_view recordField(const string_view line, const string_view key)
 {
-    if(canMessage())
+    const auto json = "\"" + string(key) + "\":";
+    if(auto pos = line.find(json); pos != string_view::npos)
     {
-        string threadLogs;
+        pos += json.size();
+        if(pos < line.size() && line[pos] == '"')
         {
-            unique_lock lck(globalMtx);
-            for(auto&i:*storedLogs)
-            {
-                lock_guard lck(i.mtx);
-                if(i.str.get()!=&cout && i.lastWasBrackets)
-                {
-                    const auto stream = static_cast<stringstream*>(i.str.get());
-                    const auto text = stream->str();
-                    stream->str(string());
-                    threadLogs+=text;
-                }
-            }
+            const auto end = line.find('"', ++pos);
+            return line.substr(pos, end == string_view::npos ? end : end - pos);
         }
-
-        if(output.lastWasBrackets)
+        const auto end = line.find_first_of(",}", pos);
+        return line.substr(pos, end == string_view::npos ? end : end - pos);
+    }
+    const auto logfmt = string(key) + '=';
+    for(size_t pos = 0; (pos = line.find(logfmt, pos)) != string_view::npos; pos += logfmt.size())
+    {
+        if(!pos || line[pos - 1] == ' ')
         {
-//            *output.str << '\n';
+            pos += logfmt.size();
+            const auto end = line.find(' ', pos);
+            return line.substr(pos, end == string_view::npos ? end : end - pos);
         }
-        else
+    }
+    return string_view();
+}
+
+bool Lout::queryLog(const string &path, ostream &out, const double from, const double to, const string &thread)
+{
+    ifstream log(path, ios::binary);
+    if(!log)
+    {
+        return false;
+    }
+    log.seekg(0, ios::end);
+    const uint64_t size = log.tellg();
+    vector<pair<uint64_t, uint64_t>> covered;
+    vector<pair<uint64_t, uint64_t>> ranges;
+    //T lines belong to the block before them, and only count if that block is in the time range
+    bool inRange = false;
+    ifstream index(path + ".idx");
+    for(string line; getline(index, line);)
+    {
+        stringstream str(line);
+        char tag;
+        if(!(str >> tag))
         {
-            const auto countOfindention = getWidth() - lastX.top();
-            indent(countOfindention, ' ', ' ');
-            printBrackets(str, color);
+            continue;
         }
-
-        if(lastX.size()>1)
+        if(tag == 'B')
         {
-            lastX.pop();
-
-            if(output.lastWasBrackets)
+            uint64_t start, end;
+            double minTs, maxTs;
+            inRange = false;
+            if(!(str >> start >> end >> minTs >> maxTs) || start >= end || end > size)
             {
-                const auto countOfindention = getWidth()  + fmt.size() + 7 ;
-                indent(countOfindention, ' ', ' ');
-                printBrackets(str, color);
+                continue;
+            }
+            covered.emplace_back(start, end);
+            inRange = maxTs >= from && minTs <= to;
+            if(inRange && thread.empty())
+            {
+                ranges.emplace_back(start, end);
             }
         }
-        else
+        else if(tag == 'T' && inRange && !thread.empty())
         {
-            resetX();
+            string name;
+            str >> name;
+            uint64_t start, end;
+            char dash;
+            while(name == thread && str >> start >> dash >> end)
+            {
+                ranges.emplace_back(start, end);
+            }
         }
-        if(!threadLogs.empty())
+    }
+    //bytes no block covers, like the tail after the last closed block or blocks lost in a crash, are scanned as is
+    sort(covered.begin(), covered.end());
+    uint64_t pos = 0;
+    for(const auto& [start, end]: covered)
+    {
+        if(start > pos)
         {
-            cout << threadLogs;
+            ranges.emplace_back(pos, start);
         }
-
-        output.lastWasBrackets = true;
-        hasAnounce = false;
+        pos = max(pos, end);
     }
-    return *this;
-}
-
-void Lout::tick()
-{    
-    brackets(std::string(1, *curTick), 33);
-    nextTick();
-}
-
-void Lout::percent(const size_t cur, const size_t total)
-{
-    if(canMessage())
+    if(pos < size)
     {
-        const size_t percent = 100 * cur / total;
-        stringstream str;
-        str << *curTick << ' ' << setw(3) << percent << '%';
-        brackets(str.str(), 33);
-        nextTick();
+        ranges.emplace_back(pos, size);
     }
-}
-
-Lout::Lout():
-             output(mkOutput()),
-             bars{"\u2591", "\u2588"},
-             fmt("dd.MM.yyyy hh:mm:ss.zzz"),
-             width(fmt.size()+1+brWidth+8)
-{    
-    lastX.push(0); 
-    logLevels.push(make_pair(Info,MessageMask(1)));
-}
+    sort(ranges.begin(), ranges.end());
 
-bool Lout::canMessage() const
-{
-    return logLevels.top().first <= outLevel && outFilterMask & logLevels.top().second;
+    for(const auto& [start, end]: ranges)
+    {
+        log.clear();
+        log.seekg(start);
+        for(string line; uint64_t(log.tellg()) < end && getline(log, line);)
+        {
+            const string ts(recordField(line, "ts"));
+            const auto value = strtod(ts.c_str(), nullptr);
+            if(value >= from && value <= to && (thread.empty() || recordField(line, "thread") == thread))
+            {
+                out << line << '\n';
+            }
+        }
+    }
+    return true;
 }
 
 void Lout::popMsgLevel()
 {
-    if(logLevels.empty())
+    if(ctx->logLevels.empty())
     {        
         *this << Info
               << '\n'
@@ -248,13 +1735,15 @@ void Lout::popMsgLevel()
               << fail;
         exit(-1);
     }    
-    logLevels.pop();
+    ctx->logLevels.pop();
+    syncLevel();
 }
 
 void Lout::noBr()
 {
     output.lastWasBrackets = false;
-    hasAnounce = false;
+    ctx->lastWasBrackets = false;
+    ctx->hasAnounce = false;
 }
 
 void Lout::indent(const size_t cnt, const char inner, const char chr)
@@ -379,6 +1868,117 @@ Lout& Lout::draw(const Picture &image)
     return *this;
 }
 
+Lout::Histogram::Histogram(const size_t shardCount):
+    shardCount(max(size_t(1), shardCount)),
+    shards(new Shard[this->shardCount])
+{
+    reset();
+}
+
+uint64_t Lout::Histogram::lowerBound(const size_t bucket)
+{
+    if(bucket < subCount)
+    {
+        return bucket;
+    }
+    const size_t exp = bucket / subCount + subBits - 1;
+    return (subCount + bucket % subCount) << (exp - subBits);
+}
+
+uint64_t Lout::Histogram::upperBound(const size_t bucket)
+{
+    return bucket + 1 < bucketCount ? lowerBound(bucket + 1) - 1 : numeric_limits<uint64_t>::max();
+}
+
+Lout::Histogram::Counts Lout::Histogram::merge() const
+{
+    Counts ret{};
+    for(size_t i=0;i<shardCount;++i)
+    {
+        for(size_t j=0;j<bucketCount;++j)
+        {
+            ret[j] += shards[i].counts[j].load(memory_order_relaxed);
+        }
+    }
+    return ret;
+}
+
+void Lout::Histogram::reset()
+{
+    for(size_t i=0;i<shardCount;++i)
+    {
+        for(auto& j: shards[i].counts)
+        {
+            j.store(0, memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t Lout::Histogram::percentile(const Counts &counts, const double q)
+{
+    const auto total = accumulate(counts.cbegin(), counts.cend(), uint64_t(0));
+    if(!total)
+    {
+        return 0;
+    }
+    const auto target = max(uint64_t(1), uint64_t(ceil(q * total)));
+    uint64_t sum = 0;
+    for(size_t i=0;i<bucketCount;++i)
+    {
+        sum += counts[i];
+        if(sum >= target)
+        {
+            return upperBound(i);
+        }
+    }
+    return upperBound(bucketCount - 1);
+}
+
+//fits histogram captions: at most 7 chars
+static string shortNum(const uint64_t value)
+{
+    constexpr array<char, 6> suffixes{'k', 'M', 'G', 'T', 'P', 'E'};
+    if(value < 10000)
+    {
+        return to_string(value);
+    }
+    double v = value;
+    size_t i = 0;
+    for(v /= 1000; v >= 1000 && i + 1 < suffixes.size(); v /= 1000, ++i);
+    stringstream str;
+    str << setprecision(v < 10 ? 2 : 3) << v << suffixes[i];
+    return str.str();
+}
+
+Lout& Lout::printHist(const Histogram &in)
+{
+    const auto counts = in.merge();
+    const auto first = find_if(counts.cbegin(), counts.cend(), [](const uint64_t v) { return v; });
+    if(first == counts.cend())
+    {
+        printHist<true>(map<uint64_t, double>());
+        return *this;
+    }
+    const size_t from = first - counts.cbegin();
+    const size_t to = counts.crend() - find_if(counts.crbegin(), counts.crend(), [](const uint64_t v) { return v; });
+
+    //neighbour buckets share a column when the range is wider than the screen
+    const size_t columns = max(ssize_t(1), ssize_t(getWidth()) - ssize_t(histCaptionWidth));
+    const size_t per = (to - from + columns - 1) / columns;
+    map<uint64_t, double> cols;
+    for(size_t i=from;i<to;++i)
+    {
+        cols[Histogram::lowerBound(from + (i - from) / per * per)] += counts[i];
+    }
+
+    printHist<true>(cols, {"n",    shortNum(accumulate(counts.cbegin(), counts.cend(), uint64_t(0))),
+                           "p50",  shortNum(Histogram::percentile(counts, 0.5)),
+                           "p99",  shortNum(Histogram::percentile(counts, 0.99)),
+                           "p999", shortNum(Histogram::percentile(counts, 0.999)),
+                           "max",  shortNum(Histogram::upperBound(to - 1))});
+    return *this;
+}
+
 void Lout::indentLineStart()
 {
     indent(fmt.size()+7+getLastX(),' ', ' ');
@@ -386,28 +1986,62 @@ void Lout::indentLineStart()
 
 void Lout::newLine()
 {
-    if(canMessage())
+    if(toRecord())
+    {
+        if(!ctx->recordOpen)
+        {
+            startRecord();
+        }
+        ctx->recordMsg += '\n';
+    }
+    newConsoleLine();
+}
+
+void Lout::newConsoleLine()
+{
+    if(toConsole())
     {
         lock_guard lck(output.mtx);
         resetX();
         *output.str << '\n';
         indentLineStart();
-        hasAnounce = true;
+        ctx->hasAnounce = true;
         output.lastWasBrackets = false;
+        ctx->lastWasBrackets = false;
     }
 }
 
 void Lout::doAnounce()
 {
-    if(canMessage())
+    if(!canMessage())
+    {
+        return;
+    }
+    emitRecord(string());
+    if(ctx->recordLineOpen)
+    {
+        ++ctx->recordNest;
+    }
+    else
+    {
+        //a fresh top-level line: whatever was left open will never be closed
+        ctx->spans = {};
+    }
+    ctx->recordLineOpen = true;
+    ctx->spans.push({tm(), string(), string()});
+    if(toRecord())
+    {
+        startRecord();
+    }
+    if(toConsole())
     {
         lock_guard lck(output.mtx);
         *output.str << '\n';
-        if( !output.lastWasBrackets || getLastX())
+        if( !ctx->lastWasBrackets || getLastX())
         {
-            const auto old = lastX.size();
+            const auto old = ctx->lastX.size();
             const auto cnt = old*4;
-            lastX.push(cnt);
+            ctx->lastX.push(cnt);
             indent((old-1)*4, ' ', ' ');
 #ifdef __FANCYLOGS_USE_QTDEBUG__
             qDebug() << "\u2514\u2500\u2500\u2500";
@@ -432,13 +2066,14 @@ void Lout::doAnounce()
 #endif
         *this<<noColor;
         output.lastWasBrackets = false;
-        hasAnounce = true;
+        ctx->lastWasBrackets = false;
+        ctx->hasAnounce = true;
     }
 }
 
 void Lout::preIndent()
 {
-    if(!hasAnounce && output.lastWasBrackets)
+    if(!ctx->hasAnounce && ctx->lastWasBrackets)
     {
         indentLineStart();
     }
@@ -453,7 +2088,24 @@ ostream& operator << (ostream& out, const string_view rhs)
 
 void Lout::print(string_view in)
 {
-    if(canMessage())
+    if(!canMessage())
+    {
+        return;
+    }
+    if(!ctx->spans.empty() && ctx->spans.top().site.empty())
+    {
+        ctx->spans.top().site = in;
+    }
+    ctx->recordLineOpen = true;
+    if(toRecord())
+    {
+        if(!ctx->recordOpen)
+        {
+            startRecord();
+        }
+        ctx->recordMsg += in;
+    }
+    if(toConsole())
     {                      
         lock_guard lck(output.mtx);
         const size_t width=getWidth();  //width of text area
@@ -495,7 +2147,7 @@ void Lout::print(string_view in)
             {
                 break;
             }
-            newLine();
+            newConsoleLine();
             in=string_view(&*in.cbegin()+len, in.length()-len);
         }
         *this << flush;
@@ -504,12 +2156,17 @@ void Lout::print(string_view in)
 
 Lout &operator <<(Lout &out, const Lout::LogLevel lvl)
 {    
-    out.logLevels.push( make_pair(lvl, out.logLevels.top().second) );
+    out.ctx->logLevels.push({lvl, out.ctx->logLevels.top().mask, out.ctx->logLevels.top().channel});
+    out.syncLevel();
     return out;
 }
 
 Lout &operator <<(Lout &out, const char *rhs)
 {
+    if(!out.ctx->spans.empty() && out.ctx->spans.top().site.empty())
+    {
+        out.ctx->spans.top().key = rhs;
+    }
     return out << string(rhs);
 }
 
@@ -551,14 +2208,12 @@ Lout &flush(Lout &out)
 
 Lout &ok(Lout &out)
 {    
-    out.brackets("OK",32);
-    return out;
+    return out.finish("OK",32);
 }
 
 Lout &fail(Lout &out)
 {
-    out.brackets("FAIL",31);
-    return out;
+    return out.finish("FAIL",31);
 }
 
 Lout &newLine(Lout &out)
@@ -603,6 +2258,11 @@ Lout &operator <<(Lout &out, const Lout::Picture &rhs)
     return out.draw(rhs);
 }
 
+Lout &operator <<(Lout &out, const Lout::Histogram &rhs)
+{
+    return out.printHist(rhs);
+}
+
 Lout &operator <<(Lout &out, const thread::id &rhs)
 {
     stringstream s;
@@ -617,7 +2277,15 @@ Lout &operator <<(Lout &out, const uint32_t rhs)
 #endif
 Lout &operator <<(Lout &out, const Lout::MessageMask &rhs)
 {
-    out.logLevels.push(make_pair( out.logLevels.top().first, rhs));
+    out.ctx->logLevels.push({out.ctx->logLevels.top().level, rhs, out.ctx->logLevels.top().channel});
+    out.syncLevel();
+    return out;
+}
+
+Lout &operator <<(Lout &out, const Lout::Channel &rhs)
+{
+    out.ctx->logLevels.push({out.ctx->logLevels.top().level, out.ctx->logLevels.top().mask, rhs});
+    out.syncLevel();
     return out;
 }
 
@@ -3,17 +3,22 @@
 
 #include <chrono>
 #include <ctime>
+#include <cmath>
 #include <array>
 #include <stack>
 #include <QString>
 #include <QDateTime>
 #include <functional>
 #include <map>
+#include <limits>
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <iostream>
 #include <sstream>
+#include <fstream>
 
 class Lout
 {
@@ -31,6 +36,10 @@ public:
         {
             return value & rhs.value;
         }
+        constexpr uint64_t getValue() const
+        {
+            return value;
+        }
     };
     class PictureElement
     {
@@ -65,6 +74,55 @@ public:
         }
     };
     using Picture=std::vector<std::vector<PictureElement>>;
+    //concurrent log-linear histogram: 16 linear sub-buckets per power of two, sharded per thread
+    class Histogram
+    {
+    public:
+        static constexpr size_t subBits = 4;
+        static constexpr size_t subCount = size_t(1) << subBits;
+        static constexpr size_t bucketCount = (65 - subBits) * subCount;
+        using Counts = std::array<uint64_t, bucketCount>;
+        static constexpr size_t maxShards = 16;
+    private:
+        struct alignas(64) Shard
+        {
+            std::array<std::atomic<uint64_t>, bucketCount> counts;
+        };
+        const size_t shardCount;
+        std::unique_ptr<Shard[]> shards;
+        inline static std::atomic<size_t> nextShard{0};
+        inline static thread_local const size_t shard = nextShard++ % maxShards;
+    public:
+        //threads map onto shards by index modulo shardCount; fewer shards trade contention for memory
+        explicit Histogram(const size_t shardCount = maxShards);
+        static size_t bucketOf(const uint64_t value)
+        {
+            if(value < subCount)
+            {
+                return value;
+            }
+#if defined(__GNUC__) || defined(__clang__)
+            const size_t exp = 63 - __builtin_clzll(value);
+#else
+            size_t exp = 0;
+            for(auto v = value; v >>= 1; ++exp);
+#endif
+            return (exp - subBits + 1) * subCount + ((value >> (exp - subBits)) & (subCount - 1));
+        }
+        static uint64_t lowerBound(const size_t bucket);
+        static uint64_t upperBound(const size_t bucket);
+        void record(const uint64_t value)
+        {
+            shards[shard % shardCount].counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        }
+        Counts merge() const;
+        void reset();
+        static uint64_t percentile(const Counts& counts, const double q);
+        uint64_t percentile(const double q) const
+        {
+            return percentile(merge(), q);
+        }
+    };
     enum LogLevel
     {
         Info,
@@ -73,24 +131,223 @@ public:
         Trace,
         DeepTrace
     };
+    //named filter channel; the threshold is resolved from the enable rules whenever they change,
+    //so the check per message is a single load and compare
+    class Channel
+    {
+        friend class Lout;
+        const std::atomic<int>* threshold;
+        const std::string* name;
+        Channel(const std::atomic<int>* threshold, const std::string* name):threshold(threshold),name(name){}
+    public:
+        Channel():threshold(&rootThreshold),name(nullptr){}
+        bool allows(const LogLevel level, const LogLevel fallback) const
+        {
+            const int limit = threshold->load(std::memory_order_relaxed);
+            return level <= (limit == inheritLevel ? int(fallback) : limit);
+        }
+        //sinks keep their own levels, only a disabled channel is off for them too
+        bool enabled() const
+        {
+            return threshold->load(std::memory_order_relaxed) != offLevel;
+        }
+    };
+    //a line of the status board at the bottom of the terminal; updates only store numbers,
+    //the console writer thread repaints changed cells at a fixed frame rate
+    class Progress
+    {
+        friend class Lout;
+        struct Slot
+        {
+            std::string label;
+            std::atomic<size_t> cur{0};
+            std::atomic<size_t> total{1};
+        };
+        Slot* slot;
+    public:
+        explicit Progress(const std::string& label, const size_t total = 100);
+        ~Progress();
+        Progress(const Progress&) = delete;
+        Progress& operator =(const Progress&) = delete;
+        void set(const size_t cur, const size_t total)
+        {
+            slot->total.store(total, std::memory_order_relaxed);
+            slot->cur.store(cur, std::memory_order_relaxed);
+        }
+        void add(const size_t count = 1)
+        {
+            slot->cur.fetch_add(count, std::memory_order_relaxed);
+        }
+    };
+    static constexpr int inheritLevel = 0x100;
+    static constexpr int offLevel = -1;
+    enum OutputFormat
+    {
+        Auto,       //Fancy on a terminal, JsonLines otherwise
+        Fancy,
+        JsonLines,
+        Logfmt
+    };
+    //what the console does when stdout can not take more output
+    enum OverflowPolicy
+    {
+        Block,          //wait for the pipe, like a plain blocking stdout
+        DropByLevel,    //drop messages above keepLevel, wait for the rest
+        Summary         //drop everything, report only the count
+    };
+    //durations of anounce ... ok/fail blocks sharing the same first literal chunk;
+    //one shard keeps a row near 8 KiB, the atomics above it are shared by all threads anyway
+    struct Timing
+    {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> min{std::numeric_limits<uint64_t>::max()};
+        std::atomic<uint64_t> max{0};
+        Histogram hist{1};
+    };
+    static constexpr size_t maxTimingSites = 256;
 private:
+    //file sink storage: a fixed put area over a plain descriptor, so a signal handler can write out
+    //what is buffered with write(2) instead of going through ofstream
+    class FileBuf: public std::streambuf
+    {
+        static constexpr size_t capacity = 8192;
+        std::array<char, capacity> data;
+        const int fd;
+    protected:
+        int_type overflow(int_type ch) override;
+        int sync() override;
+    public:
+        explicit FileBuf(const int fd):fd(fd)
+        {
+            setp(data.data(), data.data() + capacity);
+        }
+        ~FileBuf();
+        void emergencyWrite() const;
+    };
+    //extra destination for structured records, with its own filter
+    struct Sink
+    {
+        std::ostream* str = nullptr;
+        std::unique_ptr<FileBuf> file;
+        std::unique_ptr<std::ostream> owned;
+        std::mutex mtx;
+        LogLevel level = Info;
+        MessageMask mask = MessageMask::ones();
+        OutputFormat format = JsonLines;
+        //optional <file>.idx, per block of about indexBlock bytes a line "B <start> <end> <min ts> <max ts>"
+        //followed by one line per thread "T <thread> <start>-<end>..." with the byte runs of its records
+        std::unique_ptr<std::ofstream> index;
+        size_t indexBlock = 0;
+        uint64_t offset = 0;
+        uint64_t blockStart = 0;
+        double minTs = 0;
+        double maxTs = 0;
+        std::map<std::string, std::vector<std::pair<uint64_t, uint64_t>>> blockThreads;
+        void indexRecord(const double ts, const std::string& thread, const size_t len);
+        void closeBlock();
+    };
+    static constexpr size_t maxSinks = 16;
+    struct Span
+    {
+        std::chrono::steady_clock::time_point start;
+        std::string site;
+        //timing row, taken only from a const char* first chunk so built strings do not make a row each
+        std::string key;
+    };
+    //bounded queue in front of stdout, drained by its own writer thread; installed once and never freed,
+    //since threads may be inside it at any time, later settings are applied in place
+    class ConsoleBuf: public std::streambuf
+    {
+        std::mutex mtx;
+        std::condition_variable hasData;
+        std::condition_variable hasSpace;
+        std::vector<char> ring;
+        size_t head = 0;
+        size_t used = 0;
+        OverflowPolicy policy;
+        LogLevel keepLevel;
+        bool dropping = false;
+        size_t dropped = 0;
+        bool stopping = false;
+        //the writer has quit, bytes go straight to stdout from now on
+        bool stopped = false;
+        //status board state, touched by the writer thread only
+        size_t boardRows = 0;
+        size_t screenRows = 0;
+        std::vector<std::vector<std::string>> shown;
+        std::chrono::steady_clock::time_point lastFrame;
+        std::thread writer;
+        //cout is shared by every thread, so the put area is per writing thread: bytes gather there
+        //without a lock and go to the ring in one piece on flush, when it fills or when the level changes
+        struct Staging
+        {
+            static constexpr size_t size = 1024;
+            std::array<char, size> data;
+            size_t used = 0;
+            LogLevel level = Info;
+        };
+        static thread_local Staging staging;
+        void run();
+        void put(const char* s, size_t n, const LogLevel lvl);
+        void commit();
+        std::string releaseBoard();
+        void drawBoard();
+    protected:
+        int_type overflow(int_type ch) override;
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+        int sync() override;
+    public:
+        inline static thread_local LogLevel level = Info;
+        ConsoleBuf(const size_t capacity, const OverflowPolicy policy, const LogLevel keepLevel);
+        ~ConsoleBuf();
+        void configure(const size_t capacity, const OverflowPolicy policy, const LogLevel keepLevel);
+        void stop();
+        void emergencyWrite(const int fd) const;
+    };
+    //keeps worker output in a chain of fixed chunks owned by the stream, so it can be dumped from a signal handler;
+    //chunks are only ever appended and are reused after take(), memory seen by the handler is never freed or moved
+    class PendingBuf: public std::streambuf
+    {
+        static constexpr size_t capacity = 4096;
+        struct Chunk
+        {
+            std::array<char, capacity> data;
+            std::unique_ptr<Chunk> next;
+        };
+        Chunk first;
+        std::atomic<Chunk*> cur{&first};
+        //most important level written since the last take(), so the console can classify the text
+        LogLevel level = DeepTrace;
+    protected:
+        int_type overflow(int_type ch) override;
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+    public:
+        PendingBuf()
+        {
+            setp(first.data.data(), first.data.data() + capacity);
+        }
+        std::string take(LogLevel& taken);
+        void emergencyWrite(const int fd) const;
+    };
     struct ProtectedStream
     {
+        PendingBuf pending;
         std::unique_ptr<std::ostream, std::function<void(std::ostream*)>> str;
         std::recursive_mutex mtx;
+        //no unfinished line in pending, so brackets() may drain it; the layout state lives in Context
         bool lastWasBrackets = true;
-        bool operator==(const ProtectedStream& rhs) const
-        {
-            return  str==rhs.str;
-        }
-        explicit ProtectedStream(const bool isFirst):str(
+        uint32_t index = 0;
+        std::atomic<uint32_t> nextFree{0};
+        std::string trace;
+        explicit ProtectedStream(const bool isFirst = false):str(
                                                         std::unique_ptr<std::ostream,
                                                         std::function<void(std::ostream*)>
                                                        >
                                                        (
                                                            isFirst
                                                               ? &std::cout
-                                                              : new std::stringstream(),
+                                                              : new std::ostream(&pending),
                                                            [](std::ostream* in)
                                                                                {
                                                                                    if(in!=&std::cout)
@@ -103,17 +360,106 @@ private:
         {
         }
     };
+    //buffers of exited threads are never freed, but go to the lock-free free list for reuse
+    struct StreamSegment
+    {
+        static constexpr size_t size = 64;
+        std::array<ProtectedStream, size> streams;
+        explicit StreamSegment(const size_t first)
+        {
+            for(size_t i=0;i<size;++i)
+            {
+                streams[i].index = first + i;
+            }
+        }
+    };
+    static constexpr size_t maxSegments = 1024;
 
     ProtectedStream& output;
-    std::stack< std::pair<LogLevel,MessageMask> > logLevels;
+    struct MsgFilter
+    {
+        LogLevel level;
+        MessageMask mask;
+        Channel channel;
+    };
+    struct ChannelInfo
+    {
+        std::string name;
+        std::atomic<int> threshold{inheritLevel};
+    };
+    inline static std::atomic<int> rootThreshold{inheritLevel};
+    inline static std::mutex channelsMtx;
     constexpr static std::array<char,4> tickChars{'|','/','-','\\'};
+public:
+    //nesting state of one logical flow of work; a coroutine keeps its own
+    //and installs it with ContextScope whenever it resumes on some worker
+    class Context
+    {
+        friend class Lout;
+        friend Lout& operator << (Lout& out, const LogLevel lvl);
+        friend Lout& operator << (Lout& out, const MessageMask& rhs);
+        friend Lout& operator << (Lout& out, const Channel& rhs);
+        friend Lout& operator << (Lout& out, const char* rhs);
+        std::stack< MsgFilter > logLevels;
+        std::array<char,4>::const_iterator curTick=tickChars.cbegin();
+        std::stack<size_t> lastX;
+        bool hasAnounce = false;
+        //the console line of this context is still open, it may be continued on another thread
+        bool lastWasBrackets = true;
+        std::stack<Span> spans;
+        uint64_t ticks = 0;
+        //structured formats collect one record per anounce ... ok/fail line
+        bool recordOpen = false;
+        size_t recordDepth = 0;
+        MsgFilter recordFilter{Info, MessageMask::ones(), Channel()};
+        std::chrono::system_clock::time_point recordTs;
+        std::string recordMsg;
+        //record nesting, kept apart from the console layout state in lastX
+        size_t recordNest = 0;
+        bool recordLineOpen = false;
+        std::unique_ptr<Progress> progress;
+    public:
+        Context();
+    };
+    class ContextScope
+    {
+        Context* prev;
+    public:
+        explicit ContextScope(Context& ctx);
+        ~ContextScope();
+        ContextScope(const ContextScope&) = delete;
+        ContextScope& operator =(const ContextScope&) = delete;
+    };
+private:
     const std::array<std::string, 2> bars;
-    std::array<char,4>::const_iterator curTick=tickChars.cbegin();
-    std::stack<size_t> lastX;    
     LogLevel outLevel=Info;
     inline static std::mutex globalMtx;        
-    bool hasAnounce = false;    
-    inline static std::list< ProtectedStream >* storedLogs;
+    Context ownCtx;
+    Context* ctx = &ownCtx;
+    std::string threadName;
+    inline static std::atomic<OutputFormat> outputFormat{Auto};
+    inline static std::array<std::atomic<Sink*>, maxSinks> sinks{};
+    inline static std::atomic<size_t> sinkCount{0};
+    //union of all sink filters, lets canMessage() reject a record with two loads
+    inline static std::atomic<int> sinkLevel{-1};
+    inline static std::atomic<uint64_t> sinkMask{0};
+    const uint32_t traceTid;
+    bool traceNamed = false;
+    inline static std::atomic<uint32_t> nextTraceTid{0};
+    inline static std::atomic<bool> traceEnabled{false};
+    inline static std::mutex traceMtx;
+    inline static std::ofstream* traceFile = nullptr;
+    inline static std::chrono::steady_clock::time_point traceStart;
+    std::string elapsedNote;
+    inline static std::atomic<bool> timingEnabled{false};
+    inline static std::array<std::atomic<StreamSegment*>, maxSegments> segments{};
+    inline static std::atomic<size_t> allocatedStreams{0};
+    //low half is index+1 of the top free stream (0 - empty), high half is ABA tag
+    inline static std::atomic<uint64_t> freeStreams{0};
+    inline static std::atomic<size_t> liveStreams{0};
+    inline static std::atomic<bool> consoleTaken{false};
+    inline static std::atomic<bool> emergencyFlushed{false};
+    inline static std::atomic<ConsoleBuf*> consoleBuf{nullptr};
     MessageMask outFilterMask = MessageMask::ones();
 
 
@@ -125,34 +471,65 @@ private:
     void noBr();
     void preIndent();
     void printBrackets(const std::string &str, const int color);
-    static ProtectedStream& mkOutput()
+    void indentElapsed(const size_t cnt);
+    static bool structured();
+    void startRecord();
+    void emitRecord(const std::string& status);
+    void newConsoleLine();
+    bool consoleFilter() const;
+    bool sinksFilter() const;
+    bool toConsole() const;
+    bool toRecord() const;
+    static void flushSinks();
+    static size_t terminalColumns();
+    static size_t terminalRows();
+    static std::vector<Progress::Slot*>& boardSlots();
+    inline static std::mutex boardMtx;
+    inline static std::atomic<size_t> boardLines{0};
+    inline static std::atomic<int> boardPeriodMs{0};
+    static bool registerSink(Sink* sink);
+    static std::map<std::string, ChannelInfo*>& channels();
+    static std::map<std::string, int>& channelRules();
+    static int resolveChannel(const std::string& name);
+    static void setChannelRule(const std::string& pattern, const int threshold);
+    template<typename F> static void forEachSink(F&& func)
     {
-        std::lock_guard lck(globalMtx);
-        if(!storedLogs)
+        const auto count = sinkCount.load(std::memory_order_acquire);
+        for(size_t i=0; i<count; ++i)
         {
-            storedLogs = new std::list< ProtectedStream >();
+            func(*sinks[i].load(std::memory_order_relaxed));
         }
-        storedLogs->emplace_back(
-                                    storedLogs->empty()
-                               );
-        return storedLogs->back();
     }
-public:
-    ~Lout()
+    static ProtectedStream& console();
+    //walks all pooled worker streams without locking the pool, so it is usable from signal handlers
+    template<typename F> static void forEachStream(F&& func)
     {
-        std::lock_guard lck(globalMtx);
-
-        if(storedLogs)
+        const auto count = std::min(allocatedStreams.load(std::memory_order_acquire), maxSegments * StreamSegment::size);
+        for(size_t idx=0; idx<count; ++idx)
         {
-            const auto pos = find(storedLogs->cbegin(), storedLogs->cend(), output);
-            storedLogs->erase(pos);
-            if(storedLogs->empty())
+            if(const auto seg = segments[idx / StreamSegment::size].load(std::memory_order_acquire))
             {
-                delete storedLogs;
-                storedLogs = nullptr;
+                func(seg->streams[idx % StreamSegment::size]);
             }
         }
     }
+    static ProtectedStream& streamAt(const size_t index);
+    static ProtectedStream& mkOutput();
+    static void releaseOutput(ProtectedStream& out);
+    static void emergencyFlush();
+    static void onFatalSignal(int sig);
+    static void stopConsole();
+    static std::map<std::string, std::unique_ptr<Timing>>& timings();
+    void traceEvent(const std::string& name, const char phase, const std::chrono::steady_clock::time_point at, const std::string& rest);
+    static void flushTrace(ProtectedStream& out);
+    inline static std::mutex timingsMtx;
+    void syncLevel() const;
+public:
+    ~Lout()
+    {
+        emitRecord(std::string());
+        releaseOutput(output);
+    }
     Lout& setOutFilterMask(const uint64_t& rhs)
     {
         return setOutFilterMask(MessageMask(rhs));
@@ -162,6 +539,11 @@ public:
         outFilterMask = rhs;
         return *this;
     }
+    static void enableEmergencyFlush();
+    static void setConsoleOverflow(const OverflowPolicy policy,
+                                   const LogLevel keepLevel = Info,
+                                   const size_t capacity = 1 << 20);
+    Context* switchContext(Context* next);
     static Lout& getInstance()
     {
         static thread_local Lout out;
@@ -180,6 +562,34 @@ public:
     const size_t width;
     static constexpr size_t brWidth=6;        
     Lout &brackets(const std::string& str, const int color);
+    Lout &finish(const std::string& str, const int color);
+    static void enableTiming(const bool enable = true);
+    Lout &printTimings();
+    static Channel channel(const std::string& name);
+    //replaces the console level for matching channels; sinks keep filtering by their own level
+    static void setChannelLevel(const std::string& pattern, const LogLevel level);
+    static void disableChannel(const std::string& pattern);
+    static bool enableStatusBoard(const size_t lines = 8, const size_t fps = 10);
+    static void setOutputFormat(const OutputFormat format);
+    //sinks are flushed at exit, so str has to outlive main()
+    static bool addSink(std::ostream& str,
+                        const LogLevel level,
+                        const MessageMask mask = MessageMask::ones(),
+                        const OutputFormat format = JsonLines);
+    //indexBlock > 0 also maintains a time/thread index in path + ".idx" for queryLog()
+    static bool addSink(const std::string& path,
+                        const LogLevel level,
+                        const MessageMask mask = MessageMask::ones(),
+                        const OutputFormat format = JsonLines,
+                        const size_t indexBlock = 0);
+    static bool queryLog(const std::string& path,
+                         std::ostream& out,
+                         const double from = -std::numeric_limits<double>::infinity(),
+                         const double to = std::numeric_limits<double>::infinity(),
+                         const std::string& thread = std::string());
+    static OutputFormat getOutputFormat();
+    static bool enableTrace(const std::string& path);
+    static void disableTrace();
     void tick();
     void percent(const size_t cur,const size_t total);
     Lout();    
@@ -199,10 +609,14 @@ public:
     static std::string_view substr(const std::string_view &in, const size_t pos, const size_t count);
     void printW(const std::string& in, const size_t width, const std::string &filler);
     Lout &draw(const Picture &image);    
-    template<bool histMode, typename T> void printHist(const T &in)
+    Lout &printHist(const Histogram &in);
+    static constexpr size_t histCaptionWidth = 8;
+    static constexpr size_t histHeight = 20;
+    //notes go top-down into the caption of the rows without a scale value
+    template<bool histMode, typename T> void printHist(const T &in, const std::vector<std::string>& notes = {})
     {
-        constexpr size_t captionWidth = 8;
-        constexpr size_t height = 20;
+        constexpr size_t captionWidth = histCaptionWidth;
+        constexpr size_t height = histHeight;
 
         const size_t screenW = getWidth();
         const ssize_t width = screenW - captionWidth;
@@ -246,7 +660,15 @@ public:
 
             if(i & 1)
             {
-                flood(captionWidth, " ");
+                const size_t note = (height - 1 - i) / 2;
+                if(note < notes.size())
+                {
+                    printW(notes[note], captionWidth, " ");
+                }
+                else
+                {
+                    flood(captionWidth, " ");
+                }
             }
             else
             {
@@ -268,6 +690,8 @@ public:
     friend Lout &flush(Lout& out);
     friend Lout& operator << (Lout& out, const Lout::LogLevel lvl);
     friend Lout& operator << (Lout& out, const MessageMask& rhs);
+    friend Lout& operator << (Lout& out, const Channel& rhs);
+    friend Lout& operator << (Lout& out, const char* rhs);
 };
 
 Lout& operator << (Lout& out, const Lout::LogLevel lvl);
@@ -285,9 +709,11 @@ Lout& operator << (Lout& out, const uint32_t rhs);
 #endif
 Lout& operator << (Lout& out, const Lout::PictureElement& rhs);
 Lout& operator << (Lout& out, const Lout::Picture& rhs);
+Lout& operator << (Lout& out, const Lout::Histogram& rhs);
 Lout& operator << (Lout& out, const float& rhs);
 Lout& operator << (Lout& out, const std::thread::id& rhs);
 Lout& operator << (Lout& out, const Lout::MessageMask& rhs);
+Lout& operator << (Lout& out, const Lout::Channel& rhs);
 Lout& operator << (Lout& out, const std::string_view& rhs);
 
 Lout &anounce(Lout &ret);
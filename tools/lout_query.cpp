@@ -0,0 +1,45 @@
+//prints the records of a file sink that fall into a time range and optionally belong to one thread,
+//seeking through the <file>.idx sidecar written by Lout::addSink(path, ..., indexBlock)
+//build: g++ -std=c++17 -O2 -I. lout.cpp tools/lout_query.cpp `pkg-config --cflags --libs Qt5Core icu-uc` -lpthread
+//usage: lout_query <log file> [from] [to] [thread]
+//       from and to are unix timestamps in seconds, "-" leaves a bound open; thread is the id as logged
+#include "lout.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+using namespace std;
+
+static double bound(const int argc, char** argv, const int i, const double fallback)
+{
+    if(argc <= i || string(argv[i]) == "-")
+    {
+        return fallback;
+    }
+    char* end;
+    const auto ret = strtod(argv[i], &end);
+    if(*end)
+    {
+        cerr << "not a timestamp: " << argv[i] << endl;
+        exit(2);
+    }
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2 || argc > 5)
+    {
+        cerr << "usage: " << argv[0] << " <log file> [from] [to] [thread]" << endl;
+        return 2;
+    }
+    const auto from = bound(argc, argv, 2, -numeric_limits<double>::infinity());
+    const auto to = bound(argc, argv, 3, numeric_limits<double>::infinity());
+    const string thread = argc > 4 ? argv[4] : string();
+    if(!Lout::queryLog(argv[1], cout, from, to, thread))
+    {
+        cerr << "cannot open " << argv[1] << endl;
+        return 1;
+    }
+}